@@ -1,56 +1,376 @@
 #include "allocator.h"
 
+#include "mem.h"
+
 extern u8 kernel_offset;
 
 _Alignas(0x1000) static u8 buf[640 << 10];
 static u8 *phys_free_page = buf;
 static u8 *virt_free_page = &kernel_offset;
+static u8 *user_free_page = (u8 *)0x400000;
+
+// freed pages are linked through their first qword, by physical address
+static u64 dirty_pages;
+static u64 dirty_count;
+static u64 zero_pages;
+static u64 zero_count;
+
+// frames only the #PF path takes, a fault can hit while the interrupted code
+// is halfway through updating the lists above; slots are swapped atomically
+#define FAULT_RESERVE 8
+static u64 fault_reserve[FAULT_RESERVE];
+
+struct mem_stats mem_stats;
+
+// the whole of buf is mapped at kernel_offset
+static u64 *phys_to_virt(u64 phys) {
+    return (u64 *)(phys | (u64)&kernel_offset);
+}
 
 void *phys_alloc(u64 len) {
+    u64 flags = irq_save();
     phys_free_page = (u8 *)((u64)phys_free_page & ~(u64)&kernel_offset);
 
     len = (len + 0xfff) & ~(u64)0xfff;
     u8 *page = phys_free_page;
+    u64 end = ((u64)buf & ~(u64)&kernel_offset) + sizeof(buf);
+    if ((u64)page + len > end) {
+        irq_restore(flags);
+        return 0;
+    }
     phys_free_page += len;
+    irq_restore(flags);
     return page;
 }
 
+void *phys_alloc_page(void) {
+    u64 flags = irq_save();
+    u64 page = zero_pages;
+    int dirty = 0;
+    if (page) {
+        zero_pages = *phys_to_virt(page);
+        --zero_count;
+    } else if (dirty_pages) {
+        page = dirty_pages;
+        dirty_pages = *phys_to_virt(page);
+        --dirty_count;
+        dirty = 1;
+    }
+    irq_restore(flags);
+
+    // never handed out before, still zero from .bss
+    if (!page) return phys_alloc(0x1000);
+
+    if (dirty) {
+        clear_page(phys_to_virt(page));
+    } else {
+        *phys_to_virt(page) = 0;
+    }
+    return (void *)page;
+}
+
+void phys_free(void *phys) {
+    u64 flags = irq_save();
+    *phys_to_virt((u64)phys) = dirty_pages;
+    dirty_pages = (u64)phys;
+    ++dirty_count;
+    irq_restore(flags);
+}
+
+int phys_zero_one(void) {
+    u64 flags = irq_save();
+    u64 page = dirty_pages;
+    if (page) {
+        dirty_pages = *phys_to_virt(page);
+        --dirty_count;
+    }
+    irq_restore(flags);
+
+    if (!page) return 0;
+
+    // the pool is for later, don't evict the cache for it
+    clear_page_nt(phys_to_virt(page));
+
+    flags = irq_save();
+    *phys_to_virt(page) = zero_pages;
+    zero_pages = page;
+    ++zero_count;
+    irq_restore(flags);
+    return 1;
+}
+
+u64 phys_dirty_pages(void) {
+    return dirty_count;
+}
+
+void phys_refill_reserve(void) {
+    for (u32 i = 0; i < FAULT_RESERVE; ++i) {
+        if (__atomic_load_n(&fault_reserve[i], __ATOMIC_RELAXED)) continue;
+
+        u64 page = (u64)phys_alloc_page();
+        if (!page) return;
+
+        // only this fills slots, so it stays empty
+        __atomic_store_n(&fault_reserve[i], page, __ATOMIC_RELEASE);
+    }
+}
+
+static void *reserve_take(void) {
+    for (u32 i = 0; i < FAULT_RESERVE; ++i) {
+        u64 page = __atomic_exchange_n(&fault_reserve[i], 0, __ATOMIC_ACQUIRE);
+        if (page) return (void *)page;
+    }
+    return 0;
+}
+
+static u32 reserve_count(void) {
+    u32 count = 0;
+    for (u32 i = 0; i < FAULT_RESERVE; ++i) {
+        if (__atomic_load_n(&fault_reserve[i], __ATOMIC_RELAXED)) ++count;
+    }
+    return count;
+}
+
+u64 phys_used(void) {
+    u64 mask = ~(u64)&kernel_offset;
+    return ((u64)phys_free_page & mask) - ((u64)buf & mask);
+}
+
+u64 phys_pooled(void) {
+    return (dirty_count + zero_count) * 0x1000;
+}
+
+// lock-free, the #PF path accounts too
+void mem_account(u32 kind, i64 delta) {
+    u64 used = __atomic_add_fetch(&mem_stats.used[kind], delta,
+                                  __ATOMIC_RELAXED);
+    u64 peak = __atomic_load_n(&mem_stats.peak[kind], __ATOMIC_RELAXED);
+    while (used > peak &&
+           !__atomic_compare_exchange_n(&mem_stats.peak[kind], &peak, used, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
 void *virt_alloc(u64 len) {
     len = (len + 0xfff) & ~(u64)0xfff;
     virt_free_page -= len;
     return (void *)virt_free_page;
 }
 
-static void mem_map_impl(u64 start, u64 end, u64 virt, u64 phys, u64 len) {
+void *user_virt_alloc(u64 len) {
+    len = (len + 0xfff) & ~(u64)0xfff;
+    u8 *virt = user_free_page;
+    user_free_page += len;
+    return virt;
+}
+
+static u64 *entry_of(u64 k, u64 subpage) {
+    u64 entry_stub = 8 * (k / subpage);
+    entry_stub |= 0x804020100800 * (((u64)1 << 48) / subpage);
+
+    u64 signext = (entry_stub & 0x0000800000000000) ? 0xffff000000000000 : 0;
+    return (u64 *)(entry_stub | signext);
+}
+
+static void mem_map_impl(u64 start, u64 end, u64 virt, u64 phys, u64 len,
+                         u64 flags, void *(*table)(void)) {
     u64 subpage = (end - start) / 512;
 
     u64 x = subpage * max(virt / subpage, start / subpage);
     u64 y = subpage * min((virt + len + subpage - 1) / subpage, end / subpage);
 
     for (u64 k = x; k < y; k += subpage) {
-        u64 entry_stub = 8 * (k / subpage);
-        entry_stub |= 0x804020100800 * (((u64)1 << 48) / subpage);
-
-        u64 signext =
-            (entry_stub & 0x0000800000000000) ? 0xffff000000000000 : 0;
-        u64 *entry = (u64 *)(entry_stub | signext);
+        u64 *entry = entry_of(k, subpage);
 
         if (subpage == 0x1000) {
-            *entry = (phys + k - virt) | 0x3;
+            if (!(*entry & 0x1)) {
+                __atomic_fetch_add(&mem_stats.mapped[0], 0x1000,
+                                   __ATOMIC_RELAXED);
+            }
+            *entry = (phys + k - virt) | flags;
             continue;
         }
 
-        if (*entry == 0) *entry = (u64)phys_alloc(0x1000) | 0x3;
-        mem_map_impl(k, k + subpage, virt, phys, len);
+        if (*entry == 0) {
+            *entry = (u64)table() | 0x3;
+            mem_account(MEM_PAGE_TABLES, 0x1000);
+        }
+        // user access has to be allowed at every level
+        *entry |= flags & 0x4;
+        mem_map_impl(k, k + subpage, virt, phys, len, flags, table);
     }
 }
 
-void mem_map(void *phys, void *virt, u64 len) {
+static void map(void *phys, void *virt, u64 len, u64 flags) {
     if (len == 0) return;
     mem_map_impl(0, (u64)1 << 48, (u64)virt & ((u64)1 << 48) - 1, (u64)phys,
-                 len);
+                 len, flags, phys_alloc_page);
     // flush TLB
 }
 
+void mem_map(void *phys, void *virt, u64 len) {
+    map(phys, virt, len, 0x3);
+}
+
+void mem_map_user(void *phys, void *virt, u64 len) {
+    map(phys, virt, len, 0x5);
+}
+
+// returns 0 if a level above the page table is missing
+static u64 *pte_of(void *virt) {
+    u64 k = (u64)virt & ((u64)1 << 48) - 1;
+    for (u64 subpage = (u64)1 << 39; subpage > 0x1000; subpage /= 512) {
+        u64 entry = *entry_of(k, subpage);
+        if (!(entry & 0x1) || (entry & 0x80)) return 0;
+    }
+    return entry_of(k, 0x1000);
+}
+
+// page tables that have to be allocated before virt can be mapped
+static u32 tables_missing(void *virt) {
+    u64 k = (u64)virt & ((u64)1 << 48) - 1;
+    u32 missing = 0;
+    for (u64 subpage = (u64)1 << 39; subpage > 0x1000; subpage /= 512) {
+        // below a missing level there is nothing to read
+        if (missing || !(*entry_of(k, subpage) & 0x1)) ++missing;
+    }
+    return missing;
+}
+
+struct mem_region mem_regions[MAX_REGIONS];
+
+static u32 kind_of(u32 flags) {
+    return (flags & MEM_STACK) ? MEM_STACKS : MEM_HEAP;
+}
+
+static int mem_reserve(u8 *virt, u64 len, u32 kind) {
+    u64 flags = irq_save();
+    for (u32 i = 0; i < MAX_REGIONS; ++i) {
+        if (mem_regions[i].start) continue;
+        mem_regions[i] = (struct mem_region){virt, virt + len, kind, 0, 0};
+        irq_restore(flags);
+        return 1;
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+void *mem_alloc(u64 len, u32 flags) {
+    len = (len + 0xfff) & ~(u64)0xfff;
+
+    if (flags & MEM_USER) {
+        u8 *virt = user_virt_alloc(len);
+        for (u64 off = 0; off < len; off += 0x1000) {
+            map(phys_alloc_page(), virt + off, 0x1000, 0x7);
+        }
+        mem_account(kind_of(flags), len);
+        return virt;
+    }
+
+    if (flags & MEM_RESERVE) {
+        // leave an unmapped guard page below, so stack overflows fault
+        u8 *virt = (u8 *)virt_alloc(len + 0x1000) + 0x1000;
+        if (mem_reserve(virt, len, kind_of(flags))) return virt;
+
+        // out of region slots, back it eagerly
+        for (u64 off = 0; off < len; off += 0x1000) {
+            mem_map(phys_alloc_page(), virt + off, 0x1000);
+        }
+        mem_account(kind_of(flags), len);
+        return virt;
+    }
+
+    u8 *virt = virt_alloc(len);
+    for (u64 off = 0; off < len; off += 0x1000) {
+        mem_map(phys_alloc_page(), virt + off, 0x1000);
+    }
+    mem_account(kind_of(flags), len);
+    return virt;
+}
+
+int mem_fault(void *addr) {
+    u64 start = __builtin_ia32_rdtsc();
+
+    for (u32 i = 0; i < MAX_REGIONS; ++i) {
+        struct mem_region *r = &mem_regions[i];
+        if ((u8 *)addr < r->start || (u8 *)addr >= r->end) continue;
+
+        // faults don't nest, nothing else takes from the reserve meanwhile
+        void *page = (void *)((u64)addr & ~(u64)0xfff);
+        if (reserve_count() < tables_missing(page) + 1) return 0;
+
+        u64 k = (u64)page & ((u64)1 << 48) - 1;
+        mem_map_impl(0, (u64)1 << 48, k, (u64)reserve_take(), 0x1000, 0x3,
+                     reserve_take);
+
+        mem_account(r->kind, 0x1000);
+        r->faults++;
+        r->fault_cycles += __builtin_ia32_rdtsc() - start;
+        return 1;
+    }
+    return 0;
+}
+
+void mem_free(void *virt, u64 len, u32 kind_flags) {
+    len = (len + 0xfff) & ~(u64)0xfff;
+
+    // reserved regions remember what they were allocated as
+    u32 kind = kind_of(kind_flags);
+    u64 flags = irq_save();
+    for (u32 i = 0; i < MAX_REGIONS; ++i) {
+        if (mem_regions[i].start == virt) {
+            kind = mem_regions[i].kind;
+            mem_regions[i] = (struct mem_region){0};
+        }
+    }
+    irq_restore(flags);
+
+    for (u64 off = 0; off < len; off += 0x1000) {
+        u8 *page = (u8 *)virt + off;
+        u64 *entry = pte_of(page);
+        // never touched, if it was reserved
+        if (!entry || !(*entry & 0x1)) continue;
+
+        u64 phys = *entry & 0x000ffffffffff000;
+        *entry = 0;
+        invlpg(page);
+        phys_free((void *)phys);
+
+        __atomic_fetch_sub(&mem_stats.mapped[0], 0x1000, __ATOMIC_RELAXED);
+        mem_account(kind, -0x1000);
+    }
+    // TODO: the virtual range is leaked, virt_alloc can't take it back
+}
+
+void mem_stats_update(void) {
+    u64 mapped_2m = 0;
+    u64 mapped_1g = 0;
+
+    for (u64 i = 0; i < 512; ++i) {
+        // the recursive slot
+        if (i == 256) continue;
+
+        u64 pml4e = *entry_of(i << 39, (u64)1 << 39);
+        if (!(pml4e & 0x1)) continue;
+
+        for (u64 j = 0; j < 512; ++j) {
+            u64 base = i << 39 | j << 30;
+            u64 pdpte = *entry_of(base, (u64)1 << 30);
+            if (!(pdpte & 0x1)) continue;
+            if (pdpte & 0x80) {
+                mapped_1g += (u64)1 << 30;
+                continue;
+            }
+
+            for (u64 k = 0; k < 512; ++k) {
+                u64 pde = *entry_of(base | k << 21, (u64)1 << 21);
+                if ((pde & 0x81) == 0x81) mapped_2m += (u64)1 << 21;
+            }
+        }
+    }
+
+    mem_stats.mapped[1] = mapped_2m;
+    mem_stats.mapped[2] = mapped_1g;
+}
+
 extern inline void *virt_map(void *phys, u64 len);
-extern inline void *mem_alloc(u64 len);
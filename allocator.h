@@ -4,20 +4,88 @@
 
 void *virt_alloc(u64 len);
 
+// in the lower half, for ring 3
+void *user_virt_alloc(u64 len);
+
+// returns 0 once buf is used up
 void *phys_alloc(u64 len);
 
+// a single zeroed page, from the pre-zeroed pool when possible
+void *phys_alloc_page(void);
+
+void phys_free(void *phys);
+
+// zeroes one freed page into the pool, returns 0 if there was nothing to do
+int phys_zero_one(void);
+
+u64 phys_dirty_pages(void);
+
+// tops up the frames reserved for demand faults, not from the #PF path
+void phys_refill_reserve(void);
+
 void mem_map(void *phys, void *virt, u64 len);
 
+// read-only and accessible from ring 3, for code shared with user threads
+void mem_map_user(void *phys, void *virt, u64 len);
+
+// accounting categories
+#define MEM_HEAP 0
+#define MEM_STACKS 1
+#define MEM_PAGE_TABLES 2
+#define MEM_MAPPINGS 3  // virt_map, address space rather than ram
+#define MEM_KINDS 4
+
+struct mem_stats {
+    u64 used[MEM_KINDS];
+    u64 peak[MEM_KINDS];
+    // bytes mapped with 4 KiB, 2 MiB and 1 GiB pages
+    u64 mapped[3];
+};
+
+// mapped[1] and mapped[2] are only filled in by mem_stats_update
+extern struct mem_stats mem_stats;
+
+void mem_account(u32 kind, i64 delta);
+
+// walks the page tables for large pages
+void mem_stats_update(void);
+
+// pages handed out by phys_alloc and pages waiting in the free lists
+u64 phys_used(void);
+u64 phys_pooled(void);
+
 inline void *virt_map(void *phys, u64 len) {
     len = (len + 8191) & -8192;
     void *virt = virt_alloc(len);
     mem_map((void *)((u64)phys & -(u64)4096), virt, len);
+    mem_account(MEM_MAPPINGS, len);
     return (u8 *)virt + (u64)phys % 4096;
 }
 
-inline void *mem_alloc(u64 len) {
-    void *phys = phys_alloc(len);
-    void *virt = virt_alloc(len);
-    mem_map(phys, virt, len);
-    return virt;
-}
+// only reserve the virtual range, pages are backed on first touch
+#define MEM_RESERVE 1
+// writable from ring 3, always backed eagerly
+#define MEM_USER 2
+// accounted as MEM_STACKS instead of MEM_HEAP
+#define MEM_STACK 4
+
+#define MAX_REGIONS 16
+
+struct mem_region {
+    u8 *start;
+    u8 *end;
+    u32 kind;
+    u64 faults;
+    u64 fault_cycles;
+};
+
+// reserved regions, unused slots have start == 0
+extern struct mem_region mem_regions[MAX_REGIONS];
+
+void *mem_alloc(u64 len, u32 flags);
+
+// called from the page fault handler, returns 0 if addr isn't reserved
+int mem_fault(void *addr);
+
+// flags as given to mem_alloc, only needed for eager allocations
+void mem_free(void *virt, u64 len, u32 flags);
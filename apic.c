@@ -0,0 +1,77 @@
+#include "apic.h"
+
+#include <cpuid.h>
+
+#include "allocator.h"
+
+// only mapped in xapic mode
+static u8 *local_apic_address;
+
+static u8 x2apic;
+
+// reg is the xapic mmio offset, x2apic msrs are laid out the same way
+static u32 apic_read(u32 reg) {
+    if (x2apic) return rdmsr(0x800 + reg / 16);
+    return *(u32 volatile *)(local_apic_address + reg);
+}
+
+static void apic_write(u32 reg, u32 value) {
+    if (x2apic) {
+        wrmsr(0x800 + reg / 16, value);
+    } else {
+        *(u32 volatile *)(local_apic_address + reg) = value;
+    }
+}
+
+void init_apic(u64 phys) {
+    u64 apic_base = rdmsr(0x1B);
+
+    u32 eax, ebx, ecx, edx;
+    int ret = __get_cpuid(0x1, &eax, &ebx, &ecx, &edx);
+
+    if (ret && (ecx & (1 << 21))) {
+        // x2apic can only be entered from enabled xapic mode
+        apic_base |= 1 << 11;
+        wrmsr(0x1B, apic_base);
+        wrmsr(0x1B, apic_base | (1 << 10));
+        x2apic = 1;
+    } else {
+        local_apic_address = virt_map((void *)phys, 0x1000);
+    }
+
+    if (!ret || !(ecx & (1 << 24))) {
+        // TODO: tsc-deadline not supported
+    }
+
+    // software enable, don't rely on the firmware having done it; spurious
+    // interrupts go to 0xff
+    apic_write(0xF0, 0x100 | 0xFF);
+
+    apic_write(0x320, 0x40020);  // tsc-deadline mode
+}
+
+void apic_eoi(void) {
+    if (x2apic) {
+        wrmsr(0x80B, 0);
+    } else {
+        *(u32 volatile *)(local_apic_address + 0xB0) = 0;
+    }
+}
+
+u32 apic_id(void) {
+    if (x2apic) return apic_read(0x20);
+    return apic_read(0x20) >> 24;
+}
+
+void apic_send_ipi(u32 dest, u8 vector) {
+    if (x2apic) {
+        // a single msr write, no delivery status to poll
+        wrmsr(0x830, (u64)dest << 32 | vector);
+        return;
+    }
+
+    apic_write(0x310, dest << 24);
+    apic_write(0x300, vector);
+    while (apic_read(0x300) & (1 << 12)) {
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "util.h"
+
+// uses x2apic when available, otherwise maps the xapic registers at phys
+void init_apic(u64 phys);
+
+void apic_eoi(void);
+
+u32 apic_id(void);
+
+void apic_send_ipi(u32 dest, u8 vector);
@@ -179,8 +179,10 @@ continue64:
     jmp kmain
 
 extern current_thread
-extern local_apic_address
+extern apic_eoi
 extern scheduler
+extern syscall_dispatch
+extern syscall_block
 
 global timer_landpad
 timer_landpad:
@@ -211,17 +213,17 @@ timer_landpad:
     mov [rdx + 0x80], rax       ; rip
     mov rax, [rsp + 0x10]
     mov [rdx + 0x88], rax       ; rflags
+    mov rax, [rsp + 0x08]
+    mov [rdx + 0x90], rax       ; cs
+    mov rax, [rsp + 0x20]
+    mov [rdx + 0x98], rax       ; ss
 
 .no_thread:
-    ; PIC EOI
-    mov al, 0x20
-    out 0x20, al
+    lea rsp, [stack.end]
 
     ; APIC EOI
-    mov rdx, [local_apic_address]
-    mov dword [rdx + 0xB0], 0
+    call apic_eoi
 
-    lea rsp, [stack.end]
     jmp scheduler
 
 global scheduler_trampoline
@@ -246,14 +248,67 @@ scheduler_trampoline:
     lea rsp, [stack.end]
     jmp scheduler
 
+; rax, rdi, rsi, rdx, r8, r9, r10 carry the call, rcx and r11 are clobbered
+global syscall_entry
+syscall_entry:
+    mov [syscall_user_rsp], rsp
+    lea rsp, [syscall_stack.end]
+
+    ; interrupts stay masked (FMASK), the stack can't be reused under us
+    push rcx                    ; rip
+    push r11                    ; rflags
+
+    mov rcx, r10
+    mov r8, rax
+    call syscall_dispatch
+
+    pop r11
+    pop rcx
+
+    cmp byte [syscall_block], 0
+    jne .block
+
+    ; don't leak kernel values
+    xor esi, esi
+    xor edi, edi
+    xor edx, edx
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+
+    mov rsp, [syscall_user_rsp]
+    o64 sysret
+
+.block:
+    mov byte [syscall_block], 0
+
+    ; callee-saved registers still hold the user values
+    mov rdi, [current_thread]
+    mov [rdi + 0x00], rax
+    mov [rdi + 0x08], rbx
+    mov [rdi + 0x30], rbp
+    mov rax, [syscall_user_rsp]
+    mov [rdi + 0x38], rax       ; rsp
+    mov [rdi + 0x60], r12
+    mov [rdi + 0x68], r13
+    mov [rdi + 0x70], r14
+    mov [rdi + 0x78], r15
+    mov [rdi + 0x80], rcx       ; rip
+    mov [rdi + 0x88], r11       ; rflags
+    mov qword [rdi + 0x90], GDT.user_code | 3
+    mov qword [rdi + 0x98], GDT.user_data | 3
+
+    lea rsp, [stack.end]
+    jmp scheduler
+
 global launch
 launch:
     mov [current_thread], rdi
 
-    push qword GDT.data         ; ss
+    push qword [rdi + 0x98]     ; ss
     push qword [rdi + 0x38]     ; rsp
     push qword [rdi + 0x88]     ; rflags
-    push qword GDT.code         ; cs
+    push qword [rdi + 0x90]     ; cs
     push qword [rdi + 0x80]     ; rip
 
     mov r15, [rdi + 0x78]
@@ -276,10 +331,11 @@ launch:
     iretq
 
 
-section .rodata
+section .data
 
 ; Access bits
 PRESENT        equ 1 << 7
+DPL3           equ 3 << 5
 NOT_SYS        equ 1 << 4
 EXEC           equ 1 << 3
 DC             equ 1 << 2
@@ -291,6 +347,7 @@ GRAN_4K       equ 1 << 7
 SZ_32         equ 1 << 6
 LONG_MODE     equ 1 << 5
 
+global GDT
 GDT:
 .null: equ $ - GDT
     dq 0
@@ -306,9 +363,22 @@ GDT:
     db PRESENT | NOT_SYS | RW                   ; Access
     db GRAN_4K | SZ_32 | 0xF                    ; Flags & Limit (high, bits 16-19)
     db 0                                        ; Base (high, bits 24-31)
-;.TSS: equ $ - GDT
-;    dd 0x00000068
-;    dd 0x00CF8900
+; sysret wants user data right before user code
+.user_data: equ $ - GDT
+    dd 0                                        ; Limit & Base (low, bits 0-15)
+    db 0                                        ; Base (mid, bits 16-23)
+    db PRESENT | DPL3 | NOT_SYS | RW            ; Access
+    db GRAN_4K | SZ_32 | 0xF                    ; Flags & Limit (high, bits 16-19)
+    db 0                                        ; Base (high, bits 24-31)
+.user_code: equ $ - GDT
+    dd 0                                        ; Limit & Base (low, bits 0-15)
+    db 0                                        ; Base (mid, bits 16-23)
+    db PRESENT | DPL3 | NOT_SYS | EXEC | RW     ; Access
+    db GRAN_4K | LONG_MODE | 0xF                ; Flags & Limit (high, bits 16-19)
+    db 0                                        ; Base (high, bits 24-31)
+.tss: equ $ - GDT
+    dq 0                                        ; filled in by init_tss
+    dq 0
 .size: equ $ - GDT
 .hdr32:
     dw .size - 1
@@ -326,6 +396,12 @@ align 16
 stack: resb 4096
 .end:
 
+align 16
+syscall_stack: resb 4096
+.end:
+
+syscall_user_rsp: resq 1
+
 align 4096
 PML4: resb 4096
 PDPT: resb 4096
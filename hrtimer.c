@@ -0,0 +1,78 @@
+#include "hrtimer.h"
+
+// sorted by expires
+static struct hrtimer *timers;
+
+// what the tsc deadline msr holds
+static u64 programmed = -1;
+
+u64 hrtimer_callbacks;
+u64 hrtimer_batches;
+
+// the earliest point where some timer runs out of slack, everything expired
+// by then goes in the same batch
+static u64 next_batch(void) {
+    u64 next = -1;
+    for (struct hrtimer *t = timers; t && t->expires < next; t = t->next) {
+        next = min(next, t->expires + t->slack);
+    }
+    return next;
+}
+
+static void unlink(struct hrtimer *t) {
+    struct hrtimer **p = &timers;
+    while (*p != t) p = &(*p)->next;
+    *p = t->next;
+    t->armed = 0;
+}
+
+void hrtimer_arm(struct hrtimer *t, u64 expires, u64 slack,
+                 void (*fn)(struct hrtimer *)) {
+    u64 flags = irq_save();
+    if (t->armed) unlink(t);
+
+    t->expires = expires;
+    t->slack = slack;
+    t->fn = fn;
+    t->armed = 1;
+
+    struct hrtimer **p = &timers;
+    while (*p && (*p)->expires <= expires) p = &(*p)->next;
+    t->next = *p;
+    *p = t;
+
+    // the scheduler reprograms on its way out, this only has to be earlier
+    if (expires + slack < programmed) {
+        programmed = expires + slack;
+        wrmsr(0x6E0, programmed);
+    }
+    irq_restore(flags);
+}
+
+void hrtimer_cancel(struct hrtimer *t) {
+    u64 flags = irq_save();
+    if (t->armed) unlink(t);
+    irq_restore(flags);
+}
+
+void hrtimer_run(u64 now) {
+    u64 ran = 0;
+    while (timers && timers->expires <= now) {
+        struct hrtimer *t = timers;
+        timers = t->next;
+        t->armed = 0;
+        t->fn(t);
+        ++ran;
+    }
+
+    if (ran) {
+        hrtimer_callbacks += ran;
+        hrtimer_batches++;
+    }
+}
+
+u64 hrtimer_program(u64 deadline) {
+    programmed = min(deadline, next_batch());
+    wrmsr(0x6E0, programmed);
+    return programmed;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "util.h"
+
+struct hrtimer {
+    // tsc cycles, the callback may run anywhere in [expires, expires + slack]
+    u64 expires;
+    u64 slack;
+    void (*fn)(struct hrtimer *);
+
+    struct hrtimer *next;
+    u8 armed;
+};
+
+extern u64 hrtimer_callbacks;
+extern u64 hrtimer_batches;
+
+// callbacks run from the scheduler with interrupts disabled, they may re-arm
+// their own timer
+void hrtimer_arm(struct hrtimer *t, u64 expires, u64 slack,
+                 void (*fn)(struct hrtimer *));
+
+void hrtimer_cancel(struct hrtimer *t);
+
+// runs the callbacks of every timer that has expired
+void hrtimer_run(u64 now);
+
+// sets the tsc deadline to deadline or the next timer batch, whichever is
+// first, and returns it
+u64 hrtimer_program(u64 deadline);
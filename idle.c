@@ -0,0 +1,99 @@
+#include "idle.h"
+
+#include <cpuid.h>
+
+#include "apic.h"
+
+struct idle_state idle_states[MAX_CPUS];
+
+u8 idle_mwait;
+
+// sub-states per C-state (C0 to C7), from cpuid leaf 5
+static u8 substates[8];
+
+// how long the cpu has to stay idle for C(n) to pay off, in tsc cycles
+static u64 const target_residency[8] = {
+    0, 0, 44000, 220000, 880000, 2200000, 4400000, 8800000,
+};
+
+// TODO: no other cpus are started yet
+static struct idle_state *this_cpu(void) {
+    return &idle_states[0];
+}
+
+void init_idle(void) {
+    this_cpu()->apic_id = apic_id();
+
+    u32 eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x1, &eax, &ebx, &ecx, &edx)) return;
+    if (!(ecx & (1 << 3))) return;  // monitor/mwait
+
+    idle_mwait = 1;
+
+    if (!__get_cpuid(0x5, &eax, &ebx, &ecx, &edx)) return;
+    if (!(ecx & 1)) return;  // no C-state enumeration
+
+    for (u32 i = 0; i < 8; ++i) substates[i] = edx >> (4 * i) & 0xf;
+}
+
+static u32 mwait_hint(u64 deadline, u64 now) {
+    u64 expected = deadline > now ? deadline - now : 0;
+
+    // C1 is always there
+    u32 cstate = 1;
+    for (u32 i = 2; i < 8; ++i) {
+        if (substates[i] && expected >= target_residency[i]) cstate = i;
+    }
+    return (cstate - 1) << 4;
+}
+
+void idle(u64 deadline) {
+    struct idle_state *s = this_cpu();
+    s->entered_at = __builtin_ia32_rdtsc();
+    s->deadline = deadline;
+    s->active = 1;
+
+    // the timer interrupt doesn't come back here, it goes straight to the
+    // scheduler, which calls idle_exit
+    while (!s->wake) {
+        if (idle_mwait) {
+            __asm volatile("monitor" : : "a"(&s->wake), "c"(0), "d"(0));
+            if (s->wake) break;
+
+            // sti only takes effect after mwait, no wakeup can be lost
+            u32 hint = mwait_hint(deadline, __builtin_ia32_rdtsc());
+            __asm volatile("sti\n\tmwait" : : "a"(hint), "c"(0) : "memory");
+        } else {
+            __asm volatile("sti\n\thlt" : : : "memory");
+        }
+        cli();
+    }
+
+    idle_exit(__builtin_ia32_rdtsc());
+}
+
+void idle_exit(u64 now) {
+    struct idle_state *s = this_cpu();
+    if (!s->active) return;
+    s->active = 0;
+
+    s->residency += now - s->entered_at;
+    s->wakeups++;
+
+    u64 due = s->wake ? s->kicked_at : s->deadline;
+    if (now >= due) {
+        s->latency_sum += now - due;
+        s->latency_max = max(s->latency_max, now - due);
+    }
+    s->wake = 0;
+}
+
+void idle_kick(u32 cpu) {
+    struct idle_state *s = &idle_states[cpu];
+    s->kicked_at = __builtin_ia32_rdtsc();
+    s->wake = 1;
+
+    // a plain store is enough for mwait, hlt needs an interrupt: the timer
+    // vector goes through the scheduler
+    if (!idle_mwait && s->active) apic_send_ipi(s->apic_id, 0x20);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "util.h"
+
+#define MAX_CPUS 8
+
+struct __attribute__((aligned(64))) idle_state {
+    // monitored by mwait, a store here wakes the cpu up
+    u64 volatile wake;
+    u64 kicked_at;
+
+    u32 apic_id;
+    u8 active;
+    u64 entered_at;
+    u64 deadline;
+
+    u64 residency;
+    u64 wakeups;
+    u64 latency_sum;
+    u64 latency_max;
+};
+
+extern struct idle_state idle_states[MAX_CPUS];
+
+// 1 if idle uses mwait, 0 if it falls back to hlt
+extern u8 idle_mwait;
+
+void init_idle(void);
+
+// waits for an interrupt, returns only if kicked, interrupts must be disabled
+void idle(u64 deadline);
+
+// accounts the idle period that just ended, if any
+void idle_exit(u64 now);
+
+void idle_kick(u32 cpu);
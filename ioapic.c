@@ -0,0 +1,125 @@
+#include "ioapic.h"
+
+#include <sys/io.h>
+
+#include "allocator.h"
+
+#define MAX_IOAPICS 8
+
+struct ioapic {
+    u32 volatile *regs;
+    u32 gsi_base;
+    u32 count;
+};
+
+static struct ioapic ioapics[MAX_IOAPICS];
+static u32 ioapic_count;
+
+// identity mapped to gsis unless the madt overrides them
+static struct {
+    u32 gsi;
+    u16 flags;
+    u8 vector;
+} isa_irqs[16] = {
+    {0},  {1},  {2},  {3},  {4},  {5},  {6},  {7},
+    {8},  {9},  {10}, {11}, {12}, {13}, {14}, {15},
+};
+
+// 0x00-0x1f are exceptions, 0x20-0x2f are kept for the kernel (apic timer)
+static u64 used_vectors[4] = {0xffffffffffff, 0, 0, 0};
+
+static u32 ioapic_read(struct ioapic const *io, u32 reg) {
+    io->regs[0] = reg;
+    return io->regs[4];
+}
+
+static void ioapic_write(struct ioapic const *io, u32 reg, u32 value) {
+    io->regs[0] = reg;
+    io->regs[4] = value;
+}
+
+static struct ioapic const *ioapic_of(u32 gsi) {
+    for (u32 i = 0; i < ioapic_count; ++i) {
+        struct ioapic const *io = &ioapics[i];
+        if (io->gsi_base <= gsi && gsi < io->gsi_base + io->count) return io;
+    }
+    return 0;
+}
+
+void ioapic_add(u64 phys, u32 gsi_base) {
+    if (ioapic_count == MAX_IOAPICS) return;
+
+    struct ioapic *io = &ioapics[ioapic_count++];
+    io->regs = virt_map((void *)phys, 0x1000);
+    io->gsi_base = gsi_base;
+    io->count = (ioapic_read(io, 0x01) >> 16 & 0xff) + 1;
+}
+
+void ioapic_override(u8 irq, u32 gsi, u16 flags) {
+    if (irq >= 16) return;
+    isa_irqs[irq].gsi = gsi;
+    isa_irqs[irq].flags = flags;
+}
+
+void init_ioapic(void) {
+    // move the pic out of the exception range first, spurious irqs can still
+    // show up at 0xf7 and 0xff while it's masked
+    outb(0x11, 0x20);
+    outb(0x11, 0xa0);
+    outb(0xf0, 0x21);
+    outb(0xf8, 0xa1);
+    outb(0x04, 0x21);
+    outb(0x02, 0xa1);
+    outb(0x01, 0x21);
+    outb(0x01, 0xa1);
+
+    // disable pic
+    outb(0xff, 0xa1);
+    outb(0xff, 0x21);
+
+    for (u32 i = 0; i < ioapic_count; ++i) {
+        for (u32 j = 0; j < ioapics[i].count; ++j) {
+            ioapic_write(&ioapics[i], 0x10 + 2 * j, 1 << 16);
+        }
+    }
+}
+
+u8 irq_alloc_vector(void) {
+    u64 flags = irq_save();
+    // 0xf0-0xff belong to the masked pic and the apic spurious vector (0xff)
+    for (u32 v = 0x30; v < 0xf0; ++v) {
+        if (used_vectors[v / 64] & (u64)1 << v % 64) continue;
+        used_vectors[v / 64] |= (u64)1 << v % 64;
+        irq_restore(flags);
+        return v;
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+void irq_route(u8 irq, u8 vector, u32 apic_id) {
+    u32 gsi = isa_irqs[irq].gsi;
+    struct ioapic const *io = ioapic_of(gsi);
+    if (!io) return;
+
+    // isa defaults are active high, edge triggered
+    u32 low = vector;
+    if ((isa_irqs[irq].flags & 0x3) == 0x3) low |= 1 << 13;
+    if ((isa_irqs[irq].flags & 0xc) == 0xc) low |= 1 << 15;
+
+    isa_irqs[irq].vector = vector;
+
+    u32 pin = gsi - io->gsi_base;
+    ioapic_write(io, 0x10 + 2 * pin, 1 << 16);
+    ioapic_write(io, 0x11 + 2 * pin, apic_id << 24);
+    ioapic_write(io, 0x10 + 2 * pin, low);
+}
+
+void irq_set_affinity(u8 irq, u32 apic_id) {
+    struct ioapic const *io = ioapic_of(isa_irqs[irq].gsi);
+    if (!io || !isa_irqs[irq].vector) return;
+
+    // TODO: apic ids above 255 need interrupt remapping
+    u32 pin = isa_irqs[irq].gsi - io->gsi_base;
+    ioapic_write(io, 0x11 + 2 * pin, apic_id << 24);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "util.h"
+
+// madt entry type 1
+void ioapic_add(u64 phys, u32 gsi_base);
+
+// madt entry type 2, flags are the madt polarity/trigger bits
+void ioapic_override(u8 irq, u32 gsi, u16 flags);
+
+// masks the legacy pic and every ioapic pin
+void init_ioapic(void);
+
+// returns 0 when all vectors are taken
+u8 irq_alloc_vector(void);
+
+// routes a legacy isa irq to vector on the cpu with the given apic id
+void irq_route(u8 irq, u8 vector, u32 apic_id);
+
+void irq_set_affinity(u8 irq, u32 apic_id);
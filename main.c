@@ -1,8 +1,15 @@
-#include <cpuid.h>
 #include <sys/io.h>
 
 #include "allocator.h"
+#include "apic.h"
+#include "hrtimer.h"
+#include "idle.h"
+#include "ioapic.h"
+#include "mem.h"
+#include "sched.h"
 #include "screen.h"
+#include "syscall.h"
+#include "task.h"
 #include "util.h"
 
 static u32 chosen_row;
@@ -376,6 +383,225 @@ static void set_idt(
     id->zero = 0;
 }
 
+struct __attribute__((packed)) tss {
+    u32 reserved0;
+    u64 rsp[3];
+    u64 reserved1;
+    u64 ist[7];
+    u64 reserved2;
+    u16 reserved3;
+    u16 iopb;
+};
+
+static struct tss tss;
+
+extern u64 GDT[];
+
+#define TSS_SELECTOR 0x28
+
+static void init_tss(void) {
+    u64 base = (u64)&tss;
+    u64 limit = sizeof(tss) - 1;
+    GDT[TSS_SELECTOR / 8] = limit | (base & 0xffffff) << 16 |
+                            (u64)0x89 << 40 | (base >> 24 & 0xff) << 56;
+    GDT[TSS_SELECTOR / 8 + 1] = base >> 32;
+
+    tss.iopb = sizeof(tss);
+
+    // interrupts from ring 3
+    tss.rsp[0] = (u64)mem_alloc(0x4000, MEM_STACK) + 0x4000;
+
+    // a fault on a stack page that isn't backed yet can't push onto that
+    // stack
+    tss.ist[0] = (u64)mem_alloc(0x1000, MEM_STACK) + 0x1000;
+
+    // same for external interrupts, their frame would be the first touch;
+    // interrupt gates don't nest and timer_landpad leaves this stack anyway
+    tss.ist[1] = (u64)mem_alloc(0x4000, MEM_STACK) + 0x4000;
+
+    __asm volatile("ltr %w0" : : "r"(TSS_SELECTOR));
+}
+
+// kills the thread if the fault came from ring 3, halts otherwise
+static void fault(struct interrupt_frame *frame, char const *name,
+                  u64 error_code) {
+    puts("[");
+    puts(name);
+    puts("] ip ");
+    putx(frame->ip);
+    puts(" error ");
+    putx(error_code);
+
+    if (frame->cs & 3) {
+        puts(", killed thread ");
+        putu(current_thread - threads);
+        putc('\n');
+        thread_exit();
+    }
+    putc('\n');
+
+    cli();
+    for (;;) hlt();
+}
+
+#define EXCEPTION(vector, name)                                      \
+    __attribute__((interrupt)) static void exception_##vector(       \
+        struct interrupt_frame *frame) {                             \
+        fault(frame, name, 0);                                       \
+    }
+
+#define EXCEPTION_ERROR(vector, name)                                \
+    __attribute__((interrupt)) static void exception_##vector(       \
+        struct interrupt_frame *frame, u64 error_code) {             \
+        fault(frame, name, error_code);                              \
+    }
+
+EXCEPTION(0x00, "#DE")
+EXCEPTION(0x01, "#DB")
+EXCEPTION(0x03, "#BP")
+EXCEPTION(0x04, "#OF")
+EXCEPTION(0x05, "#BR")
+EXCEPTION(0x06, "#UD")
+EXCEPTION(0x07, "#NM")
+EXCEPTION_ERROR(0x08, "#DF")
+EXCEPTION_ERROR(0x0A, "#TS")
+EXCEPTION_ERROR(0x0B, "#NP")
+EXCEPTION_ERROR(0x0C, "#SS")
+EXCEPTION_ERROR(0x0D, "#GP")
+EXCEPTION(0x10, "#MF")
+EXCEPTION_ERROR(0x11, "#AC")
+EXCEPTION(0x12, "#MC")
+EXCEPTION(0x13, "#XM")
+
+__attribute__((interrupt)) static void page_fault_handler(
+    struct interrupt_frame *frame, u64 error_code) {
+    u64 addr;
+    __asm volatile("mov %%cr2, %0" : "=r"(addr));
+
+    // reserved regions are kernel memory, ring 3 doesn't get them backed
+    if (!(error_code & 5) && mem_fault((void *)addr)) return;
+
+    puts("[#PF] address ");
+    putx(addr);
+    putc('\n');
+    fault(frame, "#PF", error_code);
+}
+
+static void print_mem_regions(void) {
+    for (u32 i = 0; i < MAX_REGIONS; ++i) {
+        struct mem_region const *r = &mem_regions[i];
+        if (!r->start) continue;
+
+        puts("[mem] ");
+        putx((u64)r->start);
+        puts(" ");
+        putu((r->end - r->start) >> 10);
+        puts(" KiB, ");
+        putu(r->faults);
+        puts(" faults");
+        if (r->faults) {
+            puts(", ");
+            putu(r->fault_cycles / r->faults);
+            puts(" cycles/fault");
+        }
+        putc('\n');
+    }
+}
+
+static void print_mem_stats(void) {
+    static char const *const names[MEM_KINDS] = {
+        [MEM_HEAP] = "heap",
+        [MEM_STACKS] = "stacks",
+        [MEM_PAGE_TABLES] = "page tables",
+        [MEM_MAPPINGS] = "mappings",
+    };
+
+    mem_stats_update();
+
+    for (u32 i = 0; i < MEM_KINDS; ++i) {
+        puts("[mem] ");
+        puts(names[i]);
+        puts(": ");
+        putu(mem_stats.used[i] >> 10);
+        puts(" KiB, peak ");
+        putu(mem_stats.peak[i] >> 10);
+        puts(" KiB\n");
+    }
+
+    puts("[mem] phys ");
+    putu(phys_used() >> 10);
+    puts(" KiB used, ");
+    putu(phys_pooled() >> 10);
+    puts(" KiB free listed\n");
+
+    puts("[mem] mapped 4K ");
+    putu(mem_stats.mapped[0] >> 10);
+    puts(" KiB, 2M ");
+    putu(mem_stats.mapped[1] >> 20);
+    puts(" MiB, 1G ");
+    putu(mem_stats.mapped[2] >> 30);
+    puts(" GiB\n");
+}
+
+static void print_sched_stats(void) {
+    for (u32 i = 0; i < MAX_THREADS; ++i) {
+        struct thread const *t = &threads[i];
+        if (!t->used) continue;
+
+        if (t->class == SCHED_NORMAL) {
+            puts("[fair] thread ");
+            putu(i);
+            puts(": weight ");
+            putu(t->weight);
+            puts(", vruntime ");
+            putu(t->vruntime);
+            puts(" cycles\n");
+            continue;
+        }
+
+        puts("[rt] thread ");
+        putu(i);
+        puts(": ");
+        putu(t->activations);
+        puts(" jobs, ");
+        putu(t->misses);
+        puts(" missed, ");
+        putu(t->overruns);
+        puts(" overruns, jitter max ");
+        putu(t->jitter_max);
+        if (t->activations) {
+            puts(" avg ");
+            putu(t->jitter_sum / t->activations);
+        }
+        puts(" cycles\n");
+    }
+}
+
+static void print_idle_stats(void) {
+    for (u32 i = 0; i < MAX_CPUS; ++i) {
+        struct idle_state const *s = &idle_states[i];
+        if (!s->wakeups) continue;
+
+        puts("[idle] cpu ");
+        putu(i);
+        puts(idle_mwait ? " (mwait): " : " (hlt): ");
+        putu(s->residency * 5 / 11 / 1000000);
+        puts(" ms idle, ");
+        putu(s->wakeups);
+        puts(" wakeups, latency avg ");
+        putu(s->latency_sum / s->wakeups);
+        puts(" max ");
+        putu(s->latency_max);
+        puts(" cycles\n");
+    }
+
+    puts("[hrtimer] ");
+    putu(hrtimer_callbacks);
+    puts(" callbacks in ");
+    putu(hrtimer_batches);
+    puts(" batches\n");
+}
+
 __attribute__((interrupt)) static void keyboard_interrupt_handler(
     struct interrupt_frame *frame) {
     static char const shift_table[256] = {
@@ -448,28 +674,23 @@ __attribute__((interrupt)) static void keyboard_interrupt_handler(
             if (b == 0x25 && chosen_row > 0) {
                 set_chosen_row(chosen_row - 1);
             }
+            if (b == 0x13) {
+                print_mem_regions();
+            }
+            if (b == 0x14) {
+                print_sched_stats();
+            }
+            if (b == 0x17) {
+                print_idle_stats();
+            }
+            if (b == 0x32) {
+                print_mem_stats();
+            }
             break;
     }
 
 end:
-    outb(0x20, 0x20);
-}
-
-u8 *local_apic_address;
-
-static void init_apic(void) {
-    u64 apic_base = rdmsr(0x1B);
-    if (!(apic_base & (1 << 11))) {
-        // TODO: x2apic not supported
-    }
-
-    u32 eax, ebx, ecx, edx;
-    int ret = __get_cpuid(0x1, &eax, &ebx, &ecx, &edx);
-    if (!ret || !(ecx & (1 << 24))) {
-        // TODO: tsc-deadline not supported
-    }
-
-    *(u32 *)(local_apic_address + 0x320) = 0x40020;  // tsc-deadline mode
+    apic_eoi();
 }
 
 static void init_acpi(struct rsdt_header const *rsdt) {
@@ -481,10 +702,20 @@ static void init_acpi(struct rsdt_header const *rsdt) {
 
         if (*(u32 *)&sdt->Signature == 0x43495041) {  // APIC
             struct madt_header const *q = (struct madt_header const *)sdt;
-            // TODO: how do I find the size?
-            local_apic_address =
-                virt_map((void *)(u64)q->LocalAPICAddress, 32 << 20);
-            init_apic();
+            init_apic(q->LocalAPICAddress);
+
+            u8 const *entries = q->Entries;
+            while (entries - (u8 *)sdt < sdt->Length) {
+                if (entries[0] == 1) {
+                    ioapic_add(*(u32 *)(entries + 4), *(u32 *)(entries + 8));
+                }
+                if (entries[0] == 2) {
+                    ioapic_override(entries[3], *(u32 *)(entries + 4),
+                                    *(u16 *)(entries + 8));
+                }
+                entries += entries[1];
+            }
+            init_ioapic();
         }
     }
 }
@@ -499,7 +730,7 @@ static void init(u8 const *const mbi) {
         }
         if (tag_type == 8) {
             init_screen(mbi + i + 8);
-            for (u32 i = 0; i < sizeof(buf); ++i) buf[i] = ' ';
+            memset(buf, ' ', sizeof(buf));
             set_chosen_row(0);
         }
         if (tag_type == 14) {
@@ -513,85 +744,9 @@ static void init(u8 const *const mbi) {
     }
 }
 
-struct registers {
-    u64 rax;
-    u64 rbx;
-    u64 rcx;
-    u64 rdx;
-    u64 rsi;
-    u64 rdi;
-    u64 rbp;
-    u64 rsp;
-    u64 r8;
-    u64 r9;
-    u64 r10;
-    u64 r11;
-    u64 r12;
-    u64 r13;
-    u64 r14;
-    u64 r15;
-
-    u64 rip;
-    u64 rflags;
-};
-
-struct thread {
-    struct registers registers;
-
-    u64 wake_at;
-};
-
-struct thread threads[3];
-
-struct thread *current_thread;
-
-__attribute__((noreturn)) void launch(struct thread *p);
-
-__attribute__((noreturn)) void scheduler(void) {
-    u64 now = __builtin_ia32_rdtsc();
-
-    // puts("[sched] ");
-    // putu(now * 5 / 11 / 1000000);
-    // puts(" ms\n");
-
-    if (current_thread && current_thread->wake_at < now) {
-        current_thread->wake_at = now;
-    }
-
-    u32 min = 0;
-    u32 min2 = 0;
-    for (u32 i = 1; i < 3; ++i) {
-        if (threads[i].wake_at < threads[min].wake_at) {
-            min2 = min;
-            min = i;
-        } else if (threads[i].wake_at < threads[min2].wake_at) {
-            min2 = i;
-        }
-    }
-
-    if (threads[min].wake_at <= now) {
-        u64 timer_at = threads[min2].wake_at;
-        if (timer_at <= now) timer_at = now + 22000000;
-        wrmsr(0x6E0, timer_at);
-
-        launch(&threads[min]);
-    }
-
-    // set apic timer to fire at threads[min].wake_at
-    wrmsr(0x6E0, threads[min].wake_at);
-
-    // no thread to run
-    current_thread = 0;
-    sti();
-    for (;;) hlt();
-}
-
 void timer_landpad();
 
-void scheduler_trampoline(void);
-
 static void my_kthread1(void) {
-    u64 now = 0;
     for (;;) {
         // TODO: calling puts() in a kthread is a race condition
         u64 woken_at = __builtin_ia32_rdtsc();
@@ -599,12 +754,28 @@ static void my_kthread1(void) {
         putu(woken_at * 5 / 11 / 1000);
         puts(" us\n");
 
-        now += 2200000000;
-        current_thread->wake_at = now;
-        scheduler_trampoline();
+        rt_wait_period();
     }
 }
 
+USER static void my_uthread(void) {
+    for (;;) {
+        u64 start = __builtin_ia32_rdtsc();
+        for (u32 i = 0; i < 1000; ++i) user_syscall(SYS_NOP, 0, 0);
+        u64 end = __builtin_ia32_rdtsc();
+
+        user_syscall(SYS_PUTU, (end - start) / 1000, 0);
+        user_syscall(SYS_SLEEP, 2200000000, 0);
+    }
+}
+
+static u64 sys_putu(u64 x, u64 a1, u64 a2, u64 a3) {
+    puts("[uthread] ");
+    putu(x);
+    putc('\n');
+    return 0;
+}
+
 static u64 fib(u64 n) {
     if (n <= 1) return n;
     return fib(n - 1) + fib(n - 2);
@@ -612,14 +783,15 @@ static u64 fib(u64 n) {
 
 struct mutex {
     u64 locked;
-    struct thread *waiter;
+    // one bit per blocked thread, indexed like threads[]
+    u32 waiters;
 };
 
 static void mutex_lock(struct mutex *m) {
     for (;;) {
         cli();
         if (!m->locked) break;
-        m->waiter = current_thread;
+        m->waiters |= 1u << (current_thread - threads);
         current_thread->wake_at = (u64)1 << 50;
         scheduler_trampoline();
     }
@@ -630,10 +802,12 @@ static void mutex_lock(struct mutex *m) {
 static void mutex_unlock(struct mutex *m) {
     cli();
     m->locked = 0;
-    if (m->waiter) {
-        m->waiter->wake_at = __builtin_ia32_rdtsc();
-        m->waiter = 0;
+    // wake everyone, the losers block again
+    u64 now = __builtin_ia32_rdtsc();
+    for (u32 i = 0; i < MAX_THREADS; ++i) {
+        if (m->waiters & (1u << i)) threads[i].wake_at = now;
     }
+    m->waiters = 0;
     sti();
 }
 
@@ -681,38 +855,179 @@ static void my_kthread3(void) {
     scheduler_trampoline();
 }
 
-__attribute__((interrupt)) static void nop_handler(
-    struct interrupt_frame *frame) {
-    outb(0x20, 0x20);
+struct fib_task {
+    struct task task;
+    u64 n;
+    u64 result;
+};
+
+// below this, spawning costs more than it saves
+#define FIB_CUTOFF 20
+
+static void parallel_fib(struct task *t) {
+    struct fib_task *f = (struct fib_task *)t;
+    if (f->n < FIB_CUTOFF) {
+        f->result = fib(f->n);
+        return;
+    }
+
+    struct fib_task a = {{parallel_fib}, f->n - 1};
+    struct fib_task b = {{parallel_fib}, f->n - 2};
+    task_spawn(&a.task);
+    parallel_fib(&b.task);
+    task_sync(&a.task);
+
+    f->result = a.result + b.result;
 }
 
+static void my_kthread4(void) {
+    mutex_lock(&m);
+
+    u64 start = __builtin_ia32_rdtsc();
+    u64 f = fib(36);
+    u64 mid = __builtin_ia32_rdtsc();
+    struct fib_task root = {{parallel_fib}, 36};
+    task_run(&root.task);
+    u64 end = __builtin_ia32_rdtsc();
+
+    mutex_unlock(&m);
+
+    puts("[kthread4] fib(36) = ");
+    putu(f);
+    puts(" serial ");
+    putu((mid - start) * 5 / 11 / 1000000);
+    puts(" ms, ");
+    putu(root.result);
+    puts(" parallel ");
+    putu((end - mid) * 5 / 11 / 1000000);
+    puts(" ms on ");
+    putu(TASK_WORKERS);
+    puts(" workers, speedup x");
+    putu((mid - start) * 100 / (end - mid) / 100);
+    putc('.');
+    putu((mid - start) * 100 / (end - mid) % 100);
+    putc('\n');
+
+    current_thread->wake_at = (u64)1 << 50;
+    scheduler_trampoline();
+}
+
+static void bench_report(char const *name, u64 start, u64 end) {
+    puts("[bench] ");
+    puts(name);
+    puts(": ");
+    putu(end - start);
+    puts(" cycles\n");
+}
+
+static void bench_mem(void) {
+    u64 const len = 64 << 10;
+    u8 *a = mem_alloc(len, 0);
+    u8 *b = mem_alloc(len, 0);
+    u64 start;
+
+    // volatile keeps gcc from turning the naive loops into library calls
+    start = __builtin_ia32_rdtsc();
+    for (u64 i = 0; i < len; ++i) ((u8 volatile *)a)[i] = 0;
+    bench_report("memset naive", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    memset(a, 0, len);
+    bench_report("memset", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    memset_nt(a, 0, len);
+    bench_report("memset_nt", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    for (u64 i = 0; i < len; i += 0x1000) clear_page(a + i);
+    bench_report("clear_page", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    for (u64 i = 0; i < len; ++i) ((u8 volatile *)b)[i] = a[i];
+    bench_report("memcpy naive", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    memcpy(b, a, len);
+    bench_report("memcpy", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    memcpy_nt(b, a, len);
+    bench_report("memcpy_nt", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    for (u64 i = 0; i < len; i += 0x1000) copy_page(b + i, a + i);
+    bench_report("copy_page", start, __builtin_ia32_rdtsc());
+
+    start = __builtin_ia32_rdtsc();
+    memmove(a + 1, a, len - 1);
+    bench_report("memmove backward", start, __builtin_ia32_rdtsc());
+
+    mem_free(a, len, 0);
+    mem_free(b, len, 0);
+}
+
+// spurious interrupts don't get an EOI
+__attribute__((interrupt)) static void nop_handler(
+    struct interrupt_frame *frame) {}
+
 __attribute__((noreturn)) void kmain(u8 const *p) {
+    init_mem();
+
     // TODO: how do I find the size?
     p = virt_map(p, 32 << 20);
 
     init(p);
 
     // print_multiboot_info(p);
-
-    set_idt(&idt[0x08], nop_handler);
-    set_idt(&idt[0x09], keyboard_interrupt_handler);
+    // bench_mem();
+
+    init_tss();
+
+    set_idt(&idt[0x00], exception_0x00);
+    set_idt(&idt[0x01], exception_0x01);
+    set_idt(&idt[0x03], exception_0x03);
+    set_idt(&idt[0x04], exception_0x04);
+    set_idt(&idt[0x05], exception_0x05);
+    set_idt(&idt[0x06], exception_0x06);
+    set_idt(&idt[0x07], exception_0x07);
+    set_idt(&idt[0x08], (void *)exception_0x08);
+    set_idt(&idt[0x0A], (void *)exception_0x0A);
+    set_idt(&idt[0x0B], (void *)exception_0x0B);
+    set_idt(&idt[0x0C], (void *)exception_0x0C);
+    set_idt(&idt[0x0D], (void *)exception_0x0D);
+    set_idt(&idt[0x0E], (void *)page_fault_handler);
+    idt[0x0E].ist = 1;
+    set_idt(&idt[0x10], exception_0x10);
+    set_idt(&idt[0x11], (void *)exception_0x11);
+    set_idt(&idt[0x12], exception_0x12);
+    set_idt(&idt[0x13], exception_0x13);
     set_idt(&idt[0x20], timer_landpad);
-    set_idt(&idt[0x21], keyboard_interrupt_handler);
+    idt[0x20].ist = 2;
+    set_idt(&idt[0xF7], nop_handler);
+    idt[0xF7].ist = 2;
+    set_idt(&idt[0xFF], nop_handler);
+    idt[0xFF].ist = 2;
+
+    u8 keyboard_vector = irq_alloc_vector();
+    set_idt(&idt[keyboard_vector], keyboard_interrupt_handler);
+    idt[keyboard_vector].ist = 2;
 
     lidt(idt, sizeof(idt));
 
-    // disable pic
-    // outb(0xff, 0xa1);
-    // outb(0xff, 0x21);
-
-    threads[0].registers.rip = (u64)&my_kthread1;
-    threads[0].registers.rsp = (u64)mem_alloc(0x1000) + 0x1000;
-    threads[0].registers.rflags = 0x200;
-    threads[1].registers.rip = (u64)&my_kthread2;
-    threads[1].registers.rsp = (u64)mem_alloc(0x1000) + 0x1000;
-    threads[1].registers.rflags = 0x200;
-    threads[2].registers.rip = (u64)&my_kthread3;
-    threads[2].registers.rsp = (u64)mem_alloc(0x1000) + 0x1000;
-    threads[2].registers.rflags = 0x200;
+    irq_route(1, keyboard_vector, apic_id());
+
+    init_idle();
+    init_sched();
+    init_syscall();
+    syscall_register(SYS_PUTU, sys_putu);
+
+    struct thread *t = thread_create(my_kthread1);
+    thread_set_rt(t, 22000000, 2200000000, 2200000000);
+    thread_create(my_kthread2);
+    thread_create(my_kthread3);
+    thread_create_user(my_uthread);
+    init_tasks();
+    thread_create(my_kthread4);
     scheduler();
 }
@@ -0,0 +1,200 @@
+#include "mem.h"
+
+#include <cpuid.h>
+
+// above this size copies and fills bypass the cache, they would only evict
+// everything else
+#define NT_THRESHOLD (256 << 10)
+
+typedef u64 __attribute__((may_alias)) u64a;
+
+static inline void movnti(void *dst, u64 value) {
+    __asm volatile("movnti %1, %0" : "=m"(*(u64a *)dst) : "r"(value));
+}
+
+static void copy_movsq(u8 *dst, u8 const *src, u64 len) {
+    u64 qwords = len / 8;
+    u64 bytes = len % 8;
+    __asm volatile("rep movsq"
+                   : "+D"(dst), "+S"(src), "+c"(qwords)
+                   :
+                   : "memory");
+    __asm volatile("rep movsb"
+                   : "+D"(dst), "+S"(src), "+c"(bytes)
+                   :
+                   : "memory");
+}
+
+static void copy_movsb(u8 *dst, u8 const *src, u64 len) {
+    __asm volatile("rep movsb"
+                   : "+D"(dst), "+S"(src), "+c"(len)
+                   :
+                   : "memory");
+}
+
+// without fsrm, rep movsb has a large startup cost on short copies
+static void copy_erms(u8 *dst, u8 const *src, u64 len) {
+    if (len < 64) {
+        copy_movsq(dst, src, len);
+    } else {
+        copy_movsb(dst, src, len);
+    }
+}
+
+static void copy_backward(u8 *dst, u8 const *src, u64 len) {
+    u64 qwords = len / 8;
+    u64 bytes = len % 8;
+    dst += len - 1;
+    src += len - 1;
+
+    // DF must not be visible to interrupt handlers
+    __asm volatile(
+        "pushfq\n\t"
+        "cli\n\t"
+        "std\n\t"
+        "rep movsb\n\t"
+        "sub $7, %%rdi\n\t"
+        "sub $7, %%rsi\n\t"
+        "mov %3, %%rcx\n\t"
+        "rep movsq\n\t"
+        "popfq"
+        : "+D"(dst), "+S"(src), "+c"(bytes)
+        : "r"(qwords)
+        : "memory", "cc");
+}
+
+static void fill_stosq(u8 *dst, u8 c, u64 len) {
+    u64 pattern = 0x0101010101010101 * c;
+    u64 qwords = len / 8;
+    u64 bytes = len % 8;
+    __asm volatile("rep stosq"
+                   : "+D"(dst), "+c"(qwords)
+                   : "a"(pattern)
+                   : "memory");
+    __asm volatile("rep stosb"
+                   : "+D"(dst), "+c"(bytes)
+                   : "a"(pattern)
+                   : "memory");
+}
+
+static void fill_stosb(u8 *dst, u8 c, u64 len) {
+    __asm volatile("rep stosb" : "+D"(dst), "+c"(len) : "a"(c) : "memory");
+}
+
+static void (*copy_impl)(u8 *, u8 const *, u64) = copy_movsq;
+static void (*fill_impl)(u8 *, u8, u64) = fill_stosq;
+
+void init_mem(void) {
+    u32 eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return;
+
+    if (edx & (1 << 4)) {  // fsrm
+        copy_impl = copy_movsb;
+    } else if (ebx & (1 << 9)) {  // erms
+        copy_impl = copy_erms;
+    }
+
+    if (ebx & (1 << 9)) {  // erms
+        fill_impl = fill_stosb;
+    }
+}
+
+void *memcpy(void *dst, void const *src, u64 len) {
+    if (len >= NT_THRESHOLD) {
+        memcpy_nt(dst, src, len);
+    } else {
+        copy_impl(dst, src, len);
+    }
+    return dst;
+}
+
+void *memmove(void *dst, void const *src, u64 len) {
+    // a forward copy is fine unless dst starts inside src
+    if ((u64)dst - (u64)src >= len) return memcpy(dst, src, len);
+
+    copy_backward(dst, src, len);
+    return dst;
+}
+
+void *memset(void *dst, int c, u64 len) {
+    if (len >= NT_THRESHOLD) {
+        memset_nt(dst, c, len);
+    } else {
+        fill_impl(dst, c, len);
+    }
+    return dst;
+}
+
+void memcpy_nt(void *dst, void const *src, u64 len) {
+    u8 *d = dst;
+    u8 const *s = src;
+
+    u64 head = min(-(u64)d % 8, len);
+    copy_impl(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 32; len -= 32, d += 32, s += 32) {
+        movnti(d + 0, ((u64a const *)s)[0]);
+        movnti(d + 8, ((u64a const *)s)[1]);
+        movnti(d + 16, ((u64a const *)s)[2]);
+        movnti(d + 24, ((u64a const *)s)[3]);
+    }
+    for (; len >= 8; len -= 8, d += 8, s += 8) {
+        movnti(d, *(u64a const *)s);
+    }
+
+    copy_impl(d, s, len);
+    __asm volatile("sfence" : : : "memory");
+}
+
+void memset_nt(void *dst, u8 c, u64 len) {
+    u8 *d = dst;
+    u64 pattern = 0x0101010101010101 * c;
+
+    u64 head = min(-(u64)d % 8, len);
+    fill_impl(d, c, head);
+    d += head;
+    len -= head;
+
+    for (; len >= 32; len -= 32, d += 32) {
+        movnti(d + 0, pattern);
+        movnti(d + 8, pattern);
+        movnti(d + 16, pattern);
+        movnti(d + 24, pattern);
+    }
+    for (; len >= 8; len -= 8, d += 8) {
+        movnti(d, pattern);
+    }
+
+    fill_impl(d, c, len);
+    __asm volatile("sfence" : : : "memory");
+}
+
+void clear_page(void *page) {
+    u64 qwords = 512;
+    __asm volatile("rep stosq"
+                   : "+D"(page), "+c"(qwords)
+                   : "a"((u64)0)
+                   : "memory");
+}
+
+void clear_page_nt(void *page) {
+    u8 *p = page;
+    for (u32 i = 0; i < 4096; i += 32) {
+        movnti(p + i + 0, 0);
+        movnti(p + i + 8, 0);
+        movnti(p + i + 16, 0);
+        movnti(p + i + 24, 0);
+    }
+    __asm volatile("sfence" : : : "memory");
+}
+
+void copy_page(void *dst, void const *src) {
+    u64 qwords = 512;
+    __asm volatile("rep movsq"
+                   : "+D"(dst), "+S"(src), "+c"(qwords)
+                   :
+                   : "memory");
+}
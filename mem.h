@@ -0,0 +1,24 @@
+#pragma once
+
+#include "util.h"
+
+// picks the copy/fill strategy from cpuid, everything works before this too
+void init_mem(void);
+
+void *memcpy(void *dst, void const *src, u64 len);
+
+void *memmove(void *dst, void const *src, u64 len);
+
+void *memset(void *dst, int c, u64 len);
+
+// non-temporal variants, for targets that won't be read back soon (e.g. the
+// framebuffer)
+void memcpy_nt(void *dst, void const *src, u64 len);
+
+void memset_nt(void *dst, u8 c, u64 len);
+
+void clear_page(void *page);
+
+void clear_page_nt(void *page);
+
+void copy_page(void *dst, void const *src);
@@ -0,0 +1,263 @@
+#include "sched.h"
+
+#include "allocator.h"
+#include "hrtimer.h"
+#include "idle.h"
+#include "syscall.h"
+
+#define NICE_0_WEIGHT 1024
+
+// leave some room for normal threads, in units of 1 / (1 << 20)
+#define RT_MAX_BANDWIDTH ((95 << 20) / 100)
+
+struct thread threads[MAX_THREADS];
+
+struct thread *current_thread;
+
+// not in threads, it only runs when nothing else is runnable
+static struct thread zero_thread;
+
+static u64 rt_bandwidth;
+
+u64 sched_latency = 22000000;
+u64 sched_min_granularity = 2200000;
+
+// never decreases, sleepers are placed relative to it
+static u64 min_vruntime;
+
+__attribute__((noreturn)) void launch(struct thread *p);
+
+static void zero_kthread(void) {
+    for (;;) {
+        while (phys_zero_one()) {
+        }
+        scheduler_trampoline();
+    }
+}
+
+static void init_thread(struct thread *t, void (*entry)(void), u64 stack_size,
+                        u32 flags) {
+    t->registers.rip = (u64)entry;
+    u8 *stack = mem_alloc(stack_size, flags | MEM_STACK);
+    t->registers.rsp = (u64)stack + stack_size;
+    t->registers.rflags = 0x200;
+    t->registers.cs = 0x08;
+    t->registers.ss = 0x10;
+    t->weight = NICE_0_WEIGHT;
+}
+
+void init_sched(void) {
+    init_thread(&zero_thread, zero_kthread, 0x1000, 0);
+}
+
+static struct thread *thread_slot(void) {
+    u64 flags = irq_save();
+    for (u32 i = 0; i < MAX_THREADS; ++i) {
+        struct thread *t = &threads[i];
+        if (t->used) continue;
+
+        *t = (struct thread){.used = 1};
+        irq_restore(flags);
+        return t;
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+struct thread *thread_create(void (*entry)(void)) {
+    struct thread *t = thread_slot();
+    if (t) init_thread(t, entry, STACK_SIZE, MEM_RESERVE);
+    return t;
+}
+
+struct thread *thread_create_user(void (*entry)(void)) {
+    struct thread *t = thread_slot();
+    if (!t) return 0;
+
+    init_thread(t, (void *)user_addr(entry), STACK_SIZE, MEM_USER);
+    t->registers.cs = 0x20 | 3;
+    t->registers.ss = 0x18 | 3;
+    return t;
+}
+
+void thread_set_weight(struct thread *t, u32 weight) {
+    t->weight = max(weight, 1);
+}
+
+int thread_set_rt(struct thread *t, u64 runtime, u64 deadline, u64 period) {
+    if (!runtime || deadline < runtime || period < deadline) return 0;
+
+    // density, deadlines shorter than the period need more than runtime/period
+    u64 bandwidth = (runtime << 20) / deadline;
+
+    u64 flags = irq_save();
+    if (rt_bandwidth + bandwidth > RT_MAX_BANDWIDTH) {
+        irq_restore(flags);
+        return 0;
+    }
+    rt_bandwidth += bandwidth;
+
+    t->class = SCHED_RT;
+    t->runtime = runtime;
+    t->deadline = deadline;
+    t->period = period;
+    t->release = __builtin_ia32_rdtsc();
+    t->abs_deadline = t->release + deadline;
+    t->job_deadline = t->abs_deadline;
+    t->wake_at = t->release;
+    t->dispatched = 0;
+    irq_restore(flags);
+    return 1;
+}
+
+static void rt_next_period(struct thread *t) {
+    t->release += t->period;
+    t->abs_deadline = t->release + t->deadline;
+    t->wake_at = t->release;
+    t->dispatched = 0;
+}
+
+void thread_yield(void) {
+    cli();
+    current_thread->wake_at = __builtin_ia32_rdtsc();
+    // give up the rest of the slice too
+    current_thread->slice_end = 0;
+    scheduler_trampoline();
+    sti();
+}
+
+__attribute__((noreturn)) void thread_exit(void) {
+    cli();
+    struct thread *t = current_thread;
+    if (t->class == SCHED_RT) rt_bandwidth -= (t->runtime << 20) / t->deadline;
+    t->used = 0;
+    scheduler_trampoline();
+    __builtin_unreachable();
+}
+
+void rt_wait_period(void) {
+    cli();
+    // an overrun job was throttled into later periods, it's still late for
+    // its own deadline
+    if (__builtin_ia32_rdtsc() > current_thread->job_deadline) {
+        current_thread->misses++;
+    }
+    rt_next_period(current_thread);
+    current_thread->job_deadline = current_thread->abs_deadline;
+    scheduler_trampoline();
+    sti();
+}
+
+// launches a thread, or returns the tsc deadline that will end the idle
+static u64 schedule(void) {
+    u64 now = __builtin_ia32_rdtsc();
+    idle_exit(now);
+    hrtimer_run(now);
+
+    // on the scheduler stack, so this can't fault halfway
+    phys_refill_reserve();
+
+    struct thread *prev = current_thread;
+    if (prev && prev->class == SCHED_RT) {
+        u64 used = now - prev->launched_at;
+        prev->budget -= min(prev->budget, used);
+
+        // out of budget for this period, but not done yet
+        if (!prev->budget && prev->wake_at <= now) {
+            prev->overruns++;
+            rt_next_period(prev);
+        }
+    } else if (prev) {
+        prev->vruntime +=
+            (now - prev->launched_at) * NICE_0_WEIGHT / prev->weight;
+    }
+
+    if (prev && prev->wake_at < now) {
+        prev->wake_at = now;
+    }
+
+    struct thread *rt = 0;
+    struct thread *normal = 0;
+    u64 total_weight = 0;
+    u64 next_wake = -1;
+    u64 next_rt_wake = -1;
+
+    for (u32 i = 0; i < MAX_THREADS; ++i) {
+        struct thread *t = &threads[i];
+        if (!t->used) continue;
+
+        if (t->wake_at > now) {
+            next_wake = min(next_wake, t->wake_at);
+            if (t->class == SCHED_RT) {
+                next_rt_wake = min(next_rt_wake, t->wake_at);
+            }
+            continue;
+        }
+
+        if (t->class == SCHED_RT) {
+            if (!rt || t->abs_deadline < rt->abs_deadline) rt = t;
+        } else {
+            // a long sleep doesn't buy more than half a latency period
+            if (t->vruntime + sched_latency / 2 < min_vruntime) {
+                t->vruntime = min_vruntime - sched_latency / 2;
+            }
+
+            total_weight += t->weight;
+            if (!normal || t->vruntime < normal->vruntime) normal = t;
+        }
+    }
+
+    // earliest deadline first, normal threads only get what's left
+    if (rt) {
+        if (!rt->dispatched) {
+            u64 jitter = now - rt->release;
+            rt->jitter_max = max(rt->jitter_max, jitter);
+            rt->jitter_sum += jitter;
+            rt->activations++;
+            rt->budget = rt->runtime;
+            rt->dispatched = 1;
+        }
+
+        hrtimer_program(min(now + rt->budget, next_rt_wake));
+        rt->launched_at = now;
+        launch(rt);
+    }
+
+    if (normal) {
+        min_vruntime = max(min_vruntime, normal->vruntime);
+
+        // woken up early, don't switch away for a small vruntime difference
+        int keep = prev && prev != normal && prev->used &&
+                   prev->class == SCHED_NORMAL && prev->wake_at <= now &&
+                   now < prev->slice_end &&
+                   prev->vruntime < normal->vruntime + sched_min_granularity;
+        if (keep) normal = prev;
+
+        u64 slice_end = -1;
+        if (total_weight > normal->weight) {
+            u64 slice = sched_latency * normal->weight / total_weight;
+            slice_end = now + max(slice, sched_min_granularity);
+        }
+        normal->slice_end = keep ? min(slice_end, prev->slice_end) : slice_end;
+
+        hrtimer_program(min(next_wake, normal->slice_end));
+        normal->launched_at = now;
+        launch(normal);
+    }
+
+    // a timer batch may come before any thread wakes, idle up to that
+    u64 deadline = hrtimer_program(next_wake);
+
+    // no thread to run, spend the time refilling the zeroed page pool
+    if (phys_dirty_pages()) launch(&zero_thread);
+
+    return deadline;
+}
+
+__attribute__((noreturn)) void scheduler(void) {
+    for (;;) {
+        u64 deadline = schedule();
+        current_thread = 0;
+        idle(deadline);
+    }
+}
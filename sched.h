@@ -0,0 +1,101 @@
+#pragma once
+
+#include "util.h"
+
+struct registers {
+    u64 rax;
+    u64 rbx;
+    u64 rcx;
+    u64 rdx;
+    u64 rsi;
+    u64 rdi;
+    u64 rbp;
+    u64 rsp;
+    u64 r8;
+    u64 r9;
+    u64 r10;
+    u64 r11;
+    u64 r12;
+    u64 r13;
+    u64 r14;
+    u64 r15;
+
+    u64 rip;
+    u64 rflags;
+    u64 cs;
+    u64 ss;
+};
+
+#define SCHED_NORMAL 0
+#define SCHED_RT 1
+
+struct thread {
+    struct registers registers;
+
+    u64 wake_at;
+
+    u8 used;
+    u8 class;
+    u64 launched_at;
+
+    // SCHED_NORMAL, vruntime advances by cycles * NICE_0_WEIGHT / weight
+    u32 weight;
+    u64 vruntime;
+    u64 slice_end;
+
+    // SCHED_RT, all in tsc cycles, deadline is relative to the release
+    u64 period;
+    u64 runtime;
+    u64 deadline;
+    u64 release;
+    u64 abs_deadline;
+    u64 job_deadline;  // of the job in progress, throttling doesn't move it
+    u64 budget;
+    u8 dispatched;  // already ran in the current period
+
+    // SCHED_RT statistics
+    u64 activations;
+    u64 misses;
+    u64 overruns;
+    u64 jitter_max;
+    u64 jitter_sum;
+};
+
+#define MAX_THREADS 16
+
+// fair-share tunables in tsc cycles: every runnable SCHED_NORMAL thread gets
+// a turn within sched_latency, but never less than sched_min_granularity
+extern u64 sched_latency;
+extern u64 sched_min_granularity;
+
+// only the pages actually used get backed
+#define STACK_SIZE (64 << 10)
+
+extern struct thread threads[MAX_THREADS];
+
+extern struct thread *current_thread;
+
+void init_sched(void);
+
+struct thread *thread_create(void (*entry)(void));
+
+// entry has to be a USER function, see syscall.h
+struct thread *thread_create_user(void (*entry)(void));
+
+void thread_yield(void);
+
+// SCHED_NORMAL share, 1024 is the default
+void thread_set_weight(struct thread *t, u32 weight);
+
+// admission control, returns 0 if the thread doesn't fit
+int thread_set_rt(struct thread *t, u64 runtime, u64 deadline, u64 period);
+
+// ends the current job of a SCHED_RT thread
+void rt_wait_period(void);
+
+// the stack is leaked
+__attribute__((noreturn)) void thread_exit(void);
+
+__attribute__((noreturn)) void scheduler(void);
+
+void scheduler_trampoline(void);
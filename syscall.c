@@ -0,0 +1,56 @@
+#include "syscall.h"
+
+#include "allocator.h"
+#include "sched.h"
+
+extern u8 user_start[];
+extern u8 user_end[];
+extern u8 kernel_offset;
+
+void syscall_entry(void);
+
+u8 syscall_block;
+
+static u8 *user_text;
+
+static syscall_fn syscall_table[MAX_SYSCALLS];
+
+static u64 sys_nop(u64 a0, u64 a1, u64 a2, u64 a3) {
+    return 0;
+}
+
+static u64 sys_sleep(u64 cycles, u64 a1, u64 a2, u64 a3) {
+    current_thread->wake_at = __builtin_ia32_rdtsc() + cycles;
+    syscall_block = 1;
+    return 0;
+}
+
+void init_syscall(void) {
+    u64 len = user_end - user_start;
+    user_text = user_virt_alloc(len);
+    mem_map_user(user_start - (u64)&kernel_offset, user_text, len);
+
+    syscall_register(SYS_NOP, sys_nop);
+    syscall_register(SYS_SLEEP, sys_sleep);
+
+    wrmsr(0xC0000080, rdmsr(0xC0000080) | 1);  // EFER.SCE
+
+    // sysret uses 0x10 + 16 for cs and 0x10 + 8 for ss
+    wrmsr(0xC0000081, (u64)0x10 << 48 | (u64)0x08 << 32);
+    wrmsr(0xC0000082, (u64)syscall_entry);
+    // clear TF, IF, DF, IOPL, NT and AC on entry
+    wrmsr(0xC0000084, 0x47700);
+}
+
+void syscall_register(u32 nr, syscall_fn fn) {
+    if (nr < MAX_SYSCALLS) syscall_table[nr] = fn;
+}
+
+u64 user_addr(void (*fn)(void)) {
+    return (u64)user_text + ((u8 *)fn - user_start);
+}
+
+u64 syscall_dispatch(u64 a0, u64 a1, u64 a2, u64 a3, u64 nr) {
+    if (nr >= MAX_SYSCALLS || !syscall_table[nr]) return -1;
+    return syscall_table[nr](a0, a1, a2, a3);
+}
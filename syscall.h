@@ -0,0 +1,36 @@
+#pragma once
+
+#include "util.h"
+
+#define SYS_NOP 0
+#define SYS_SLEEP 1  // a0: tsc cycles
+#define SYS_PUTU 2   // a0: number to print
+
+#define MAX_SYSCALLS 16
+
+typedef u64 (*syscall_fn)(u64 a0, u64 a1, u64 a2, u64 a3);
+
+// code that runs in ring 3, it's aliased into the lower half so it can only
+// use its own stack and other USER functions
+#define USER __attribute__((section(".user.text")))
+
+// maps the USER code and enables syscall/sysret
+void init_syscall(void);
+
+void syscall_register(u32 nr, syscall_fn fn);
+
+// the address a USER function has in the lower half
+u64 user_addr(void (*fn)(void));
+
+// set by a handler that put current_thread to sleep
+extern u8 syscall_block;
+
+// rcx, r11 and the argument registers don't survive the call
+__attribute__((always_inline)) static inline u64 user_syscall(u64 nr, u64 a0,
+                                                               u64 a1) {
+    __asm volatile("syscall"
+                   : "+a"(nr), "+D"(a0), "+S"(a1)
+                   :
+                   : "rcx", "rdx", "r8", "r9", "r10", "r11", "memory");
+    return nr;
+}
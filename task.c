@@ -0,0 +1,223 @@
+#include "task.h"
+
+#include "hrtimer.h"
+
+// Chase-Lev: the owner pushes and pops at bottom, thieves take from top
+struct deque {
+    i64 top;
+    i64 bottom;
+    struct task *tasks[DEQUE_SIZE];
+};
+
+struct worker {
+    struct deque deque;
+    struct thread *thread;
+    u32 id;
+    u8 parked;
+    struct hrtimer park_timer;
+};
+
+static struct worker workers[TASK_WORKERS];
+
+// roots from task_run, taken by whichever worker gets there first
+static struct task *injected;
+
+// bounds the cost of a missed unpark
+#define PARK_TIMEOUT 22000000
+// a late park timeout only costs latency, let the workers' timers batch
+#define PARK_SLACK (PARK_TIMEOUT / 2)
+
+static int deque_push(struct deque *d, struct task *t) {
+    i64 b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    i64 top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - top >= DEQUE_SIZE) return 0;
+
+    __atomic_store_n(&d->tasks[b & (DEQUE_SIZE - 1)], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static struct task *deque_pop(struct deque *d) {
+    i64 b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    struct task *t =
+        __atomic_load_n(&d->tasks[b & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == b) {
+        // last one, race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            t = 0;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+static struct task *deque_steal(struct deque *d) {
+    i64 top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b) return 0;
+
+    struct task *t =
+        __atomic_load_n(&d->tasks[top & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return t;
+}
+
+static struct worker *self(void) {
+    for (u32 i = 0; i < TASK_WORKERS; ++i) {
+        if (workers[i].thread == current_thread) return &workers[i];
+    }
+    return 0;
+}
+
+static void unpark_one(void) {
+    u64 flags = irq_save();
+    for (u32 i = 0; i < TASK_WORKERS; ++i) {
+        if (!workers[i].parked) continue;
+        workers[i].parked = 0;
+        workers[i].thread->wake_at = __builtin_ia32_rdtsc();
+        break;
+    }
+    irq_restore(flags);
+}
+
+static int done(struct task *t) {
+    return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE) == TASK_DONE;
+}
+
+static void run(struct task *t) {
+    t->fn(t);
+
+    // the owner may return and reuse *t as soon as it sees TASK_DONE, so this
+    // has to be the last access to it
+    u64 flags = irq_save();
+    struct thread *waiter =
+        __atomic_exchange_n(&t->state, TASK_DONE, __ATOMIC_ACQ_REL);
+    if (waiter) waiter->wake_at = __builtin_ia32_rdtsc();
+    irq_restore(flags);
+}
+
+// sleeps until run() finishes t, or timeout
+static void wait(struct task *t, u64 timeout) {
+    cli();
+    struct thread *expected = 0;
+    if (__atomic_compare_exchange_n(&t->state, &expected, current_thread, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        current_thread->wake_at = __builtin_ia32_rdtsc() + timeout;
+        scheduler_trampoline();
+
+        // timed out, withdraw unless run() got there first
+        expected = current_thread;
+        __atomic_compare_exchange_n(&t->state, &expected, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    sti();
+}
+
+static struct task *find_work(struct worker *w) {
+    struct task *t = deque_pop(&w->deque);
+    if (t) return t;
+
+    t = __atomic_exchange_n(&injected, 0, __ATOMIC_ACQUIRE);
+    if (t) return t;
+
+    for (u32 i = 1; i < TASK_WORKERS; ++i) {
+        t = deque_steal(&workers[(w->id + i) % TASK_WORKERS].deque);
+        if (t) return t;
+    }
+    return 0;
+}
+
+static void park_timeout(struct hrtimer *t) {
+    u64 offset = __builtin_offsetof(struct worker, park_timer);
+    struct worker *w = (struct worker *)((u8 *)t - offset);
+    w->thread->wake_at = __builtin_ia32_rdtsc();
+}
+
+static void worker_main(void) {
+    struct worker *w = self();
+    for (;;) {
+        struct task *t = find_work(w);
+        if (t) {
+            run(t);
+            continue;
+        }
+
+        cli();
+        w->parked = 1;
+        // usually cancelled by an unpark long before it runs
+        hrtimer_arm(&w->park_timer, __builtin_ia32_rdtsc() + PARK_TIMEOUT,
+                    PARK_SLACK, park_timeout);
+        current_thread->wake_at = (u64)1 << 50;
+        scheduler_trampoline();
+        hrtimer_cancel(&w->park_timer);
+        w->parked = 0;
+        sti();
+    }
+}
+
+void init_tasks(void) {
+    for (u32 i = 0; i < TASK_WORKERS; ++i) {
+        // the worker looks itself up as soon as it runs
+        u64 flags = irq_save();
+        workers[i].id = i;
+        workers[i].thread = thread_create(worker_main);
+        irq_restore(flags);
+    }
+}
+
+void task_run(struct task *t) {
+    t->state = 0;
+
+    // one root at a time, the workers pick it up quickly
+    for (;;) {
+        struct task *expected = 0;
+        if (__atomic_compare_exchange_n(&injected, &expected, t, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        thread_yield();
+    }
+    unpark_one();
+
+    while (!done(t)) {
+        wait(t, (u64)1 << 50);
+    }
+}
+
+void task_spawn(struct task *t) {
+    t->state = 0;
+
+    struct worker *w = self();
+    if (!deque_push(&w->deque, t)) {
+        run(t);
+        return;
+    }
+    unpark_one();
+}
+
+void task_sync(struct task *t) {
+    struct worker *w = self();
+    while (!done(t)) {
+        struct task *other = find_work(w);
+        if (other) {
+            run(other);
+        } else {
+            // stolen and still running somewhere else
+            wait(t, PARK_TIMEOUT);
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "sched.h"
+#include "util.h"
+
+struct task {
+    void (*fn)(struct task *);
+    // 0, the thread to wake up when the task finishes, or TASK_DONE
+    struct thread *state;
+};
+
+#define TASK_DONE ((struct thread *)1)
+
+#define TASK_WORKERS 4
+
+// must be a power of two
+#define DEQUE_SIZE 1024
+
+void init_tasks(void);
+
+// runs t on the workers and sleeps until it's done, for non-worker threads
+void task_run(struct task *t);
+
+// makes t available to other workers, runs it inline if the deque is full;
+// only from inside a task
+void task_spawn(struct task *t);
+
+// runs or steals other tasks until t is done
+void task_sync(struct task *t);
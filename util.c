@@ -8,6 +8,12 @@ extern inline void sti(void);
 
 extern inline void cli(void);
 
+extern inline u64 irq_save(void);
+
+extern inline void irq_restore(u64 flags);
+
+extern inline void invlpg(void *virt);
+
 extern inline u64 rdmsr(u32 msr);
 
 extern inline void wrmsr(u32 msr, u64 value);
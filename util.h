@@ -32,6 +32,21 @@ inline void cli(void) {
     __asm("cli");
 }
 
+// disables interrupts, returns the previous rflags for irq_restore
+inline u64 irq_save(void) {
+    u64 flags;
+    __asm volatile("pushfq\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+inline void irq_restore(u64 flags) {
+    if (flags & 0x200) sti();
+}
+
+inline void invlpg(void *virt) {
+    __asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
 inline u64 rdmsr(u32 msr) {
     u32 low, high;
     __asm("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));